@@ -0,0 +1,108 @@
+#include "checksum.h"
+#include <array>
+#include <cstring>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#include <nmmintrin.h>
+#define CHECKSUM_X86
+#define CHECKSUM_TARGET
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <nmmintrin.h>
+#define CHECKSUM_X86
+#define CHECKSUM_TARGET __attribute__((target("sse4.2")))
+#endif
+
+namespace
+{
+    // the reflected polynomial
+    const std::uint32_t polynomial = 0x82f63b78;
+
+    // slicing-by-8 tables for the portable implementation
+    using tables_type = std::array<std::array<std::uint32_t, 256>, 8>;
+
+    const tables_type& tables()
+    {
+        static const tables_type result = [] () {
+            tables_type t;
+            for (std::uint32_t i = 0; i < 256; ++i)
+            {
+                std::uint32_t crc = i;
+                for (int j = 0; j < 8; ++j)
+                    crc = (crc >> 1) ^ (polynomial & (0 - (crc & 1)));
+                t[0][i] = crc;
+            }
+            for (std::uint32_t i = 0; i < 256; ++i)
+                for (std::size_t j = 1; j < t.size(); ++j)
+                    t[j][i] = (t[j - 1][i] >> 8) ^ t[0][t[j - 1][i] & 0xff];
+            return t;
+        }();
+        return result;
+    }
+
+    std::uint32_t software(std::uint32_t crc, const unsigned char* first, const unsigned char* last)
+    {
+        const auto& t(tables());
+        for (; 8 <= last - first; first += 8)
+        {
+            std::uint32_t lo, hi;
+            std::memcpy(&lo, first, sizeof(lo));
+            std::memcpy(&hi, first + 4, sizeof(hi));
+            // the tables assume little endian byte order, it is true for all platforms we build for
+            lo ^= crc;
+            crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+                t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+        }
+        for (; first != last; ++first)
+            crc = (crc >> 8) ^ t[0][(crc ^ *first) & 0xff];
+        return crc;
+    }
+
+#ifdef CHECKSUM_X86
+    CHECKSUM_TARGET
+    std::uint32_t hardware(std::uint32_t crc, const unsigned char* first, const unsigned char* last)
+    {
+#if defined(__x86_64__) || defined(_M_X64)
+        std::uint64_t crc64 = crc;
+        for (; 8 <= last - first; first += 8)
+        {
+            std::uint64_t v;
+            std::memcpy(&v, first, sizeof(v));
+            crc64 = _mm_crc32_u64(crc64, v);
+        }
+        crc = static_cast<std::uint32_t>(crc64);
+#endif
+        for (; 4 <= last - first; first += 4)
+        {
+            std::uint32_t v;
+            std::memcpy(&v, first, sizeof(v));
+            crc = _mm_crc32_u32(crc, v);
+        }
+        for (; first != last; ++first)
+            crc = _mm_crc32_u8(crc, *first);
+        return crc;
+    }
+
+    bool has_hardware()
+    {
+#ifdef _MSC_VER
+        int info[4] = {};
+        __cpuid(info, 1);
+        return (info[2] & (1 << 20)) != 0;
+#else
+        return __builtin_cpu_supports("sse4.2") != 0;
+#endif
+    }
+#endif
+}
+
+std::uint32_t checksum::crc32c(std::uint32_t crc, const void* data, std::size_t size)
+{
+    const auto first(static_cast<const unsigned char*>(data));
+#ifdef CHECKSUM_X86
+    static const bool hw = has_hardware();
+    if (hw)
+        return ~hardware(~crc, first, first + size);
+#endif
+    return ~software(~crc, first, first + size);
+}
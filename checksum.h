@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace checksum
+{
+    // CRC32C (Castagnoli), the same polynomial is used by iSCSI, ext4, leveldb and so on
+    // the function uses the crc32 instruction if the processor supports it
+    // the result of the previous call can be passed as crc to continue the calculation
+    // (like zlib crc32), so crc32c(crc32c(0, a, n), b, m) == crc32c(0, ab, n + m)
+    std::uint32_t crc32c(std::uint32_t crc, const void* data, std::size_t size);
+}
@@ -1,7 +1,14 @@
 #include "generator.h"
+#include "checksum.h"
+#include <array>
+#include <fstream>
 #include <numeric>
 #include <stdexcept>
 
+#ifdef _MSC_VER
+#include <xmmintrin.h>
+#endif
+
 using namespace text::generator;
 
 namespace
@@ -12,6 +19,21 @@ namespace
         return distribution(urng);
     }
 
+    inline std::size_t frequency(const std::unordered_map<std::size_t, std::size_t>& m, std::size_t pos)
+    {
+        const auto iter(m.find(pos));
+        return iter == m.end() ? 0 : iter->second;
+    }
+
+    inline void prefetch(const void* p)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_prefetch(p);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        _mm_prefetch(static_cast<const char*>(p), _MM_HINT_T0);
+#endif
+    }
+
     struct exceptions
     {
         std::ios& ios;
@@ -22,8 +44,65 @@ namespace
         { ios.exceptions(except); }
     };
 
+    // every model section is followed by its checksum, so a truncated or corrupted model
+    // is detected while it is being loaded rather than while a text is being generated
+    class osection
+    {
+    public:
+        explicit osection(std::ostream& os) : os(os) {}
+
+        template<class T>
+        void write(const T* data, std::size_t count)
+        {
+            crc = checksum::crc32c(crc, data, sizeof(T)*count);
+            os.write(reinterpret_cast<const char*>(data), sizeof(T)*count);
+        }
+
+        void close()
+        {
+            const std::size_t v(crc);
+            os.write(reinterpret_cast<const char*>(&v), sizeof(v));
+        }
+
+    private:
+        std::ostream& os;
+        std::uint32_t crc{};
+    };
+
+    class isection
+    {
+    public:
+        explicit isection(std::istream& is) : is(is) {}
+
+        template<class T>
+        void read(T* data, std::size_t count)
+        {
+            is.read(reinterpret_cast<char*>(data), sizeof(T)*count);
+            crc = checksum::crc32c(crc, data, sizeof(T)*count);
+        }
+
+        void close()
+        {
+            std::size_t v{};
+            is.read(reinterpret_cast<char*>(&v), sizeof(v));
+            if (v != crc)
+                is.setstate(std::ios_base::failbit);
+        }
+
+    private:
+        std::istream& is;
+        std::uint32_t crc{};
+    };
+
+    // a model starts with the magic and the format version, the version is incremented
+    // on every incompatible change of the format (models before the version have no magic)
+    const std::array<char, 8> model_magic = {{ 't', 'e', 'x', 't', 'g', 'e', 'n', '\0' }};
+    const std::size_t model_version = 1;
+
     struct header
     {
+        std::array<char, 8> magic;
+        std::size_t version;
         std::size_t pref_size;
         std::size_t word_data_size;
         std::size_t word_index_size;
@@ -34,7 +113,7 @@ namespace
 
         std::size_t hash() const
         {
-            const auto a = { pref_size, word_data_size, word_index_size,
+            const auto a = { version, pref_size, word_data_size, word_index_size,
                 pref_data_size, pref_index_size, table_size };
             return std::accumulate(std::begin(a), std::end(a), std::size_t{},
                 [h = std::hash<std::size_t>()] (auto l, auto r) { return l ^ h(r); });
@@ -86,6 +165,23 @@ std::size_t model::find(const std::list<std::size_t>& pref) const
     return iter == pref_index.end() ? ~std::size_t() : *iter;
 }
 
+void model::assign(model& m)
+{
+    word_index.clear();
+    word_data = std::move(m.word_data);
+    // the positions are sorted, so the insertion with the hint takes constant time
+    std::copy(m.word_index.begin(), m.word_index.end(), std::inserter(word_index, word_index.end()));
+    m.word_index.clear();
+    pref_index = decltype(pref_index)(lgcmp(pref_data, m.pref_size()));
+    pref_data = std::move(m.pref_data);
+    std::copy(m.pref_index.begin(), m.pref_index.end(), std::inserter(pref_index, pref_index.end()));
+    m.pref_index.clear();
+    table = std::move(m.table);
+    m.word_data.clear();
+    m.pref_data.clear();
+    m.table.clear();
+}
+
 void training::model::train(std::list<std::size_t>& state, const char* word)
 {
     const auto word_pos(insert(word));
@@ -102,33 +198,303 @@ void training::model::train(std::list<std::size_t>& state, const char* word)
     word_stat.second = state.back();
 }
 
+void training::model::train(std::list<std::size_t>& state, const chunk& c)
+{
+    std::vector<std::size_t> word_pos(c.words.size());
+    std::transform(c.words.begin(), c.words.end(), word_pos.begin(),
+        [this] (const auto& word) { return insert(word.c_str()); });
+    // the prefixes of the first words contain words of the previous chunk
+    std::for_each(c.head.begin(), c.head.end(),
+        [this, &state, &c] (auto id) { train(state, c.words[id].c_str()); });
+    if (c.last == ~std::size_t())
+        return;
+    const auto size(pref_size());
+    std::vector<std::size_t> pref_pos(size ? c.prefs.size() / size : 1);
+    for (std::size_t i = 0; i < pref_pos.size(); ++i)
+    {
+        std::list<std::size_t> pref;
+        std::transform(c.prefs.begin() + i * size, c.prefs.begin() + (i + 1) * size, std::back_inserter(pref),
+            [&word_pos] (auto id) { return word_pos[id]; });
+        pref_pos[i] = insert(pref);
+    }
+    std::for_each(c.table.begin(), c.table.end(), [this, &word_pos, &pref_pos] (const auto& entry) {
+        auto& second(table[pref_pos[entry.first]]);
+        std::for_each(entry.second.begin(), entry.second.end(), [&second, &word_pos, &pref_pos] (const auto& suffix) {
+            auto& word_stat(second[word_pos[suffix.first]]);
+            word_stat.first += suffix.second.first;
+            word_stat.second = pref_pos[suffix.second.second];
+        });
+    });
+    state.clear();
+    std::transform(c.prefs.begin() + c.last * size, c.prefs.begin() + (c.last + 1) * size, std::back_inserter(state),
+        [&word_pos] (auto id) { return word_pos[id]; });
+    state.push_back(pref_pos[c.last]);
+}
+
+training::chunk training::count(const std::vector<std::string>& words, std::size_t pref_size)
+{
+    chunk result;
+    std::vector<std::size_t> ids;
+    ids.reserve(words.size());
+    std::unordered_map<std::string, std::size_t> word_ids;
+    std::for_each(words.begin(), words.end(), [&result, &ids, &word_ids] (const auto& word) {
+        const auto inserted(word_ids.emplace(word, result.words.size()));
+        if (inserted.second)
+            result.words.push_back(word);
+        ids.push_back(inserted.first->second);
+    });
+    const auto head(std::min(pref_size, ids.size()));
+    result.head.assign(ids.begin(), ids.begin() + head);
+    if (head == ids.size())
+        return result;
+    // a prefix is a sequence of pref_size ids in the chunk, prefixes are indexed by the hash of their ids
+    std::unordered_multimap<std::size_t, std::size_t> pref_ids;
+    const auto pref_id = [&result, &pref_ids, pref_size] (auto first)
+    {
+        const auto hash(std::accumulate(first, first + pref_size, std::size_t(),
+            [] (auto h, auto id) { return h * 1000003 ^ id; }));
+        const auto range(pref_ids.equal_range(hash));
+        const auto iter(std::find_if(range.first, range.second, [&result, first, pref_size] (const auto& p)
+            { return std::equal(first, first + pref_size, result.prefs.begin() + p.second * pref_size); }));
+        if (iter != range.second)
+            return iter->second;
+        const auto id(pref_ids.size());
+        pref_ids.emplace(hash, id);
+        result.prefs.insert(result.prefs.end(), first, first + pref_size);
+        return id;
+    };
+    // positions of prefixes in result.table
+    std::vector<std::size_t> entries;
+    auto pref(pref_id(ids.begin()));
+    for (auto iter = ids.begin() + pref_size; iter != ids.end(); ++iter)
+    {
+        const auto next(pref_id(iter + 1 - pref_size));
+        entries.resize(pref_ids.size(), ~std::size_t());
+        if (entries[pref] == ~std::size_t())
+        {
+            entries[pref] = result.table.size();
+            result.table.emplace_back();
+            result.table.back().first = pref;
+        }
+        auto& word_stat(result.table[entries[pref]].second[*iter]);
+        ++word_stat.first;
+        word_stat.second = next;
+        pref = next;
+    }
+    result.last = pref;
+    return result;
+}
+
+void training::model::reorder()
+{
+    std::unordered_map<std::size_t, std::size_t> word_freq, pref_freq;
+    std::for_each(table.begin(), table.end(), [&word_freq, &pref_freq] (const auto& v) {
+        std::for_each(v.second.begin(), v.second.end(), [&word_freq, &pref_freq, &v] (const auto& w) {
+            word_freq[w.first] += w.second.first;
+            pref_freq[v.first] += w.second.first;
+        });
+    });
+
+    // the most frequent words first, the stable sort keeps the order of first appearance otherwise
+    std::vector<std::size_t> words(word_index.begin(), word_index.end());
+    std::sort(words.begin(), words.end());
+    std::stable_sort(words.begin(), words.end(), [&word_freq] (auto l, auto r) {
+        return frequency(word_freq, l) > frequency(word_freq, r);
+    });
+
+    // we start a chain from the most frequent prefix which is not placed yet
+    // and follow the most frequent suffix while its prefix is not placed yet
+    std::vector<std::size_t> heads(pref_index.begin(), pref_index.end());
+    std::sort(heads.begin(), heads.end());
+    std::stable_sort(heads.begin(), heads.end(), [&pref_freq] (auto l, auto r) {
+        return frequency(pref_freq, l) > frequency(pref_freq, r);
+    });
+    std::vector<std::size_t> prefs;
+    std::unordered_map<std::size_t, std::size_t> pref_map;
+    for (auto head : heads)
+    {
+        for (auto pos = head; pref_map.emplace(pos, 0).second; )
+        {
+            prefs.push_back(pos);
+            const auto iter(table.find(pos));
+            if (iter == table.end() || iter->second.empty())
+                break;
+            pos = std::max_element(iter->second.begin(), iter->second.end(), [] (const auto& l, const auto& r) {
+                return l.second.first < r.second.first;
+            })->second.second;
+        }
+    }
+
+    // the indexes refer to the buffers, so we clear them before the buffers are replaced
+    decltype(word_data) old_word_data;
+    decltype(pref_data) old_pref_data;
+    word_index.clear();
+    pref_index.clear();
+    old_word_data.swap(word_data);
+    old_pref_data.swap(pref_data);
+
+    std::unordered_map<std::size_t, std::size_t> word_map;
+    std::for_each(words.begin(), words.end(), [this, &word_map, &old_word_data] (auto pos) {
+        word_map[pos] = insert(&old_word_data[pos]);
+    });
+    std::for_each(prefs.begin(), prefs.end(), [this, &word_map, &pref_map, &old_pref_data] (auto pos) {
+        std::list<std::size_t> pref;
+        std::transform(old_pref_data.begin() + pos, old_pref_data.begin() + pos + pref_size(),
+            std::back_inserter(pref), [&word_map] (auto w) { return word_map[w]; });
+        pref_map[pos] = insert(pref);
+    });
+
+    // the table is rebuilt in the chain order too, so its nodes are allocated in the same order
+    decltype(table) old_table;
+    old_table.swap(table);
+    table.reserve(old_table.size());
+    std::for_each(prefs.begin(), prefs.end(), [this, &word_map, &pref_map, &old_table] (auto pos) {
+        const auto iter(old_table.find(pos));
+        if (iter == old_table.end())
+            return;
+        auto& second(table[pref_map[pos]]);
+        std::for_each(iter->second.begin(), iter->second.end(), [&second, &word_map, &pref_map] (const auto& v) {
+            second.emplace(word_map[v.first], std::make_pair(v.second.first, pref_map[v.second.second]));
+        });
+        old_table.erase(iter);
+    });
+}
+
 void training::model::save(std::ostream& os) const
 {
     const exceptions e(os, std::ios_base::failbit | std::ios_base::badbit);
     const std::ostream::sentry s(os);
 
-    header h = { pref_size(), word_data.size(), word_index.size(),
+    header h = { model_magic, model_version, pref_size(), word_data.size(), word_index.size(),
         pref_data.size(), pref_index.size(), table.size()};
     h.checksum = h.hash();
     os.write(reinterpret_cast<const char*>(&h), sizeof(h));
 
-    os.write(word_data.data(), word_data.size());
-    std::for_each(word_index.begin(), word_index.end(), [&os] (auto v) {
-        os.write(reinterpret_cast<const char*>(&v), sizeof(v));
+    osection words(os);
+    words.write(word_data.data(), word_data.size());
+    words.close();
+    osection word_positions(os);
+    std::for_each(word_index.begin(), word_index.end(), [&word_positions] (auto v) {
+        word_positions.write(&v, 1);
     });
-    os.write(reinterpret_cast<const char*>(pref_data.data()),
-        sizeof(*pref_data.data())*pref_data.size());
-    std::for_each(pref_index.begin(), pref_index.end(), [&os] (auto v) {
-        os.write(reinterpret_cast<const char*>(&v), sizeof(v));
+    word_positions.close();
+    osection prefs(os);
+    prefs.write(pref_data.data(), pref_data.size());
+    prefs.close();
+    osection pref_positions(os);
+    std::for_each(pref_index.begin(), pref_index.end(), [&pref_positions] (auto v) {
+        pref_positions.write(&v, 1);
     });
-    std::for_each(table.begin(), table.end(), [&os] (const auto& v) {
+    pref_positions.close();
+    // the table is written in the prefix order, so load allocates the nodes in the same order
+    // (the chain order after reorder, the order of first appearance otherwise)
+    std::vector<const decltype(table)::value_type*> entries;
+    entries.reserve(table.size());
+    std::transform(table.begin(), table.end(), std::back_inserter(entries), [] (const auto& v) { return &v; });
+    std::sort(entries.begin(), entries.end(), [] (auto l, auto r) { return l->first < r->first; });
+    osection suffixes(os);
+    std::for_each(entries.begin(), entries.end(), [&suffixes] (auto p) {
+        const auto& v(*p);
         const std::size_t a[] = { v.first, v.second.size() };
-        os.write(reinterpret_cast<const char*>(a), sizeof(a));
-        std::for_each(v.second.begin(), v.second.end(), [&os] (const auto& v) {
+        suffixes.write(a, 2);
+        std::for_each(v.second.begin(), v.second.end(), [&suffixes] (const auto& v) {
             const std::size_t a[] = { v.first, v.second.first, v.second.second };
-            os.write(reinterpret_cast<const char*>(a), sizeof(a));
+            suffixes.write(a, 3);
         });
     });
+    suffixes.close();
+}
+
+template<class F>
+void generating::model::generate(std::list<std::size_t>& state, std::default_random_engine& urng,
+    std::size_t size, F f) const
+{
+    while (size != 0)
+    {
+        const auto iter(table.find(state.back()));
+        // no such prefix
+        if (iter == table.end())
+            return;
+        if (iter->second.size() != 1)
+        {
+            f(generate(iter->second, state, urng));
+            --size;
+            continue;
+        }
+        // the rest of the run
+        for (auto run = run_data.begin() + iter->second.begin()->second.first;
+            size != 0 && run->first != ~std::size_t(); ++run, --size)
+        {
+            f(run->first);
+            state.back() = run->second;
+        }
+    }
+}
+
+template<class F>
+void generating::model::generate(std::vector<std::list<std::size_t>>& states,
+    std::vector<std::default_random_engine>& urngs, std::size_t size, F f) const
+{
+    // the suffixes of the next prefix of every session (nullptr if the session is finished)
+    // and the number of words the session still has to generate
+    std::vector<const decltype(table)::mapped_type*> next(states.size());
+    std::vector<std::size_t> rest(states.size(), size);
+    // we prefetch what a session needs first: the run of the only suffix or the first and the last suffix
+    // (the frequency of the last suffix is the first thing we need, the first suffix is close to the root)
+    const auto find = [this, &states, &next] (std::size_t i) {
+        const auto iter(table.find(states[i].back()));
+        next[i] = iter == table.end() ? nullptr : &iter->second;
+        if (next[i] == nullptr || next[i]->empty())
+            return;
+        if (next[i]->size() == 1)
+            prefetch(&run_data[next[i]->begin()->second.first]);
+        else
+        {
+            prefetch(&*next[i]->begin());
+            prefetch(&*next[i]->rbegin());
+        }
+    };
+    for (std::size_t i = 0; i < states.size(); ++i)
+        find(i);
+    // the sessions are processed in blocks, every session of a block takes its word and then the next prefixes
+    // of the block are found together, so their cache misses overlap, and they are used by the next pass
+    // (after the other blocks), so the prefetched suffixes are ready
+    const std::size_t block_size = 16;
+    for (bool active = true; active; )
+    {
+        active = false;
+        for (std::size_t first = 0; first < states.size(); first += block_size)
+        {
+            const auto last(std::min(first + block_size, states.size()));
+            for (auto i = first; i < last; ++i)
+            {
+                if (next[i] == nullptr || rest[i] == 0)
+                    continue;
+                if (next[i]->size() != 1)
+                {
+                    f(i, generate(*next[i], states[i], urngs[i]));
+                    --rest[i];
+                    continue;
+                }
+                // the rest of the run, as in the version for one session
+                for (auto run = run_data.begin() + next[i]->begin()->second.first;
+                    rest[i] != 0 && run->first != ~std::size_t(); ++run, --rest[i])
+                {
+                    f(i, run->first);
+                    states[i].back() = run->second;
+                }
+            }
+            // the next prefix of a session which is done is found by the next call
+            for (auto i = first; i < last; ++i)
+            {
+                if (next[i] != nullptr && rest[i] != 0)
+                {
+                    find(i);
+                    active = true;
+                }
+            }
+        }
+    }
 }
 
 const char* generating::model::generate(std::list<std::size_t>& state,
@@ -138,20 +504,75 @@ const char* generating::model::generate(std::list<std::size_t>& state,
     // no such prefix
     if (iter == table.end())
         return nullptr;
-    const auto& second(iter->second);
+    return &word_data[word_positions[generate(iter->second, state, urng)]];
+}
+
+void generating::model::generate(std::list<std::size_t>& state, std::default_random_engine& urng,
+    std::vector<const char*>& words, std::size_t size) const
+{
+    generate(state, urng, size, [this, &words] (auto id) {
+        words.push_back(&word_data[word_positions[id]]);
+    });
+}
+
+void generating::model::generate(std::list<std::size_t>& state, std::default_random_engine& urng,
+    std::vector<std::size_t>& ids, std::size_t size) const
+{
+    generate(state, urng, size, [&ids] (auto id) {
+        ids.push_back(id);
+    });
+}
+
+void generating::model::generate(std::vector<std::list<std::size_t>>& states, std::vector<std::default_random_engine>& urngs,
+    std::vector<std::vector<const char*>>& words, std::size_t size) const
+{
+    generate(states, urngs, size, [this, &words] (auto i, auto id) {
+        words[i].push_back(&word_data[word_positions[id]]);
+    });
+}
+
+void generating::model::generate(std::vector<std::list<std::size_t>>& states, std::vector<std::default_random_engine>& urngs,
+    std::vector<std::vector<std::size_t>>& ids, std::size_t size) const
+{
+    generate(states, urngs, size, [&ids] (auto i, auto id) {
+        ids[i].push_back(id);
+    });
+}
+
+const char* generating::model::word(std::size_t id) const
+{
+    if (word_positions.size() <= id)
+        throw std::out_of_range("invalid word id");
+    return &word_data[word_positions[id]];
+}
+
+std::size_t generating::model::word_position(std::size_t id) const
+{
+    if (word_positions.size() <= id)
+        throw std::out_of_range("invalid word id");
+    return word_positions[id];
+}
+
+std::size_t generating::model::generate(const decltype(table)::mapped_type& second,
+    std::list<std::size_t>& state, std::default_random_engine& urng) const
+{
     // for some reason the suffixes are empty, a logic error or somebody corrupted the model
     if (second.empty())
         throw std::invalid_argument("invalid prefix");
+    // we do not need a random number if there is the only suffix,
+    // its word is in run_data (see compress)
+    if (second.size() == 1)
+    {
+        state.back() = second.begin()->second.second;
+        return run_data[second.begin()->second.first].first;
+    }
     const auto second_iter(second.lower_bound(random(1, second.rbegin()->first, urng)));
     // for some reason frequencies are inconsistent, a logic error or somebody corrupted the model
     if (second_iter == second.end())
         throw std::invalid_argument("invalid frequency");
-    // for some reason the position of a word is out of range, a logic error or somebody corrupted the model
-    if (word_data.size() <= second_iter->second.first)
-        throw std::invalid_argument("invalid word");
     // prepare the next prefix
     state.back() = second_iter->second.second;
-    return &word_data[second_iter->second.first];
+    return second_iter->second.first;
 }
 
 void generating::model::load(std::istream& is)
@@ -160,40 +581,198 @@ void generating::model::load(std::istream& is)
     const std::istream::sentry s(is, true);
 
     header h = {};
-    is.read(reinterpret_cast<char*>(&h), sizeof(h));
-    if (h.hash() != h.checksum)
-        is.setstate(std::ios_base::failbit);
-
-    word_data.resize(h.word_data_size);
-    is.read(word_data.data(), word_data.size());
-    std::generate_n(std::inserter(word_index, word_index.end()), h.word_index_size, [&is, &h] () {
-        std::size_t v{};
-        is.read(reinterpret_cast<char*>(&v), sizeof(v));
-        if (h.word_data_size < v + 1)
-            is.setstate(std::ios_base::failbit);
-        return v;
-    });
-    pref_data.resize(h.pref_data_size);
-    is.read(reinterpret_cast<char*>(pref_data.data()), sizeof(*pref_data.data())*pref_data.size());
-    pref_index = decltype(pref_index)(lgcmp(pref_data, h.pref_size));
-    std::generate_n(std::inserter(pref_index, pref_index.end()), h.pref_index_size, [&is, &h] () {
-        std::size_t v{};
-        is.read(reinterpret_cast<char*>(&v), sizeof(v));
-        if (h.pref_data_size < v + h.pref_size)
+    // stream errors are reported as a truncated or a corrupted model
+    try
+    {
+        is.read(reinterpret_cast<char*>(&h), sizeof(h));
+        if (h.magic != model_magic)
+            throw std::runtime_error("invalid model (not a model or a model of an old format)");
+        if (h.version != model_version)
+            throw std::runtime_error("unsupported model format version " + std::to_string(h.version));
+        if (h.hash() != h.checksum)
             is.setstate(std::ios_base::failbit);
-        return v;
-    });
-    std::generate_n(std::inserter(table, table.end()), h.table_size, [&is] () {
-        std::size_t a[2] = {};
-        is.read(reinterpret_cast<char*>(a), sizeof(a));
+
+        isection words(is);
+        word_data.resize(h.word_data_size);
+        words.read(word_data.data(), word_data.size());
+        words.close();
+        isection word_positions(is);
+        std::generate_n(std::inserter(word_index, word_index.end()), h.word_index_size, [&is, &h, &word_positions] () {
+            std::size_t v{};
+            word_positions.read(&v, 1);
+            if (h.word_data_size < v + 1)
+                is.setstate(std::ios_base::failbit);
+            return v;
+        });
+        word_positions.close();
+        isection prefs(is);
+        pref_data.resize(h.pref_data_size);
+        prefs.read(pref_data.data(), pref_data.size());
+        prefs.close();
+        pref_index = decltype(pref_index)(lgcmp(pref_data, h.pref_size));
+        isection pref_positions(is);
+        std::generate_n(std::inserter(pref_index, pref_index.end()), h.pref_index_size, [&is, &h, &pref_positions] () {
+            std::size_t v{};
+            pref_positions.read(&v, 1);
+            if (h.pref_data_size < v + h.pref_size)
+                is.setstate(std::ios_base::failbit);
+            return v;
+        });
+        pref_positions.close();
+        isection suffixes(is);
+        std::generate_n(std::inserter(table, table.end()), h.table_size, [&suffixes] () {
+            std::size_t a[2] = {};
+            suffixes.read(a, 2);
+            decltype(table)::value_type::second_type second;
+            std::generate_n(std::inserter(second, second.end()), a[1], [&suffixes, sum = std::size_t{}] () mutable {
+                std::size_t a[3] = {};
+                suffixes.read(a, 3);
+                // there is a trick, we replace the word with the upper bound of the word frequency range
+                // we do not break the set ordering because inserted frequencies are sorted
+                return std::make_pair(sum += a[1], std::make_pair(a[0], a[2]));
+            });
+            return std::make_pair(a[0], std::move(second));
+        });
+        suffixes.close();
+    }
+    catch (const std::ios_base::failure&)
+    {
+        if (is.bad())
+            throw;
+        throw std::runtime_error(is.eof() ? "truncated model" : "corrupted model");
+    }
+    number();
+    compress();
+}
+
+void generating::model::freeze(training::model& m)
+{
+    assign(m);
+    std::for_each(table.begin(), table.end(), [] (auto& v) {
         decltype(table)::value_type::second_type second;
-        std::generate_n(std::inserter(second, second.end()), a[1], [&is, sum = std::size_t{}] () mutable {
-            std::size_t a[3] = {};
-            is.read(reinterpret_cast<char*>(a), sizeof(a));
-            // there is a trick, we replace the word with the upper bound of the word frequency range
-            // we do not break the set ordering because inserted frequencies are sorted
-            return std::make_pair(sum += a[1], std::make_pair(a[0], a[2]));
+        // the same trick as in load, the word is replaced with the upper bound of the word frequency range
+        std::transform(v.second.begin(), v.second.end(), std::inserter(second, second.end()), [sum = std::size_t{}] (const auto& v) mutable {
+            return std::make_pair(sum += v.second.first, std::make_pair(v.first, v.second.second));
+        });
+        v.second = std::move(second);
+    });
+    number();
+    compress();
+}
+
+void generating::model::number()
+{
+    word_positions.clear();
+    for (auto iter = word_data.begin(); iter != word_data.end(); iter = std::find(iter, word_data.end(), '\0') + 1)
+    {
+        word_positions.push_back(iter - word_data.begin());
+        // for some reason the last word is not terminated, a logic error or somebody corrupted the model
+        if (std::find(iter, word_data.end(), '\0') == word_data.end())
+            throw std::invalid_argument("invalid word");
+    }
+    // word positions are sorted, so we find ids using binary search
+    std::for_each(table.begin(), table.end(), [this] (auto& v) {
+        std::for_each(v.second.begin(), v.second.end(), [this] (auto& v) {
+            const auto iter(std::lower_bound(word_positions.begin(), word_positions.end(), v.second.first));
+            // for some reason the position of a word is out of range, a logic error or somebody corrupted the model
+            if (iter == word_positions.end() || *iter != v.second.first)
+                throw std::invalid_argument("invalid word");
+            v.second.first = iter - word_positions.begin();
         });
-        return std::make_pair(a[0], std::move(second));
     });
 }
+
+void generating::model::compress()
+{
+    // a run starts with a prefix which does not follow another prefix with the only suffix
+    // the rest are cycles, they start anywhere
+    std::vector<bool> followers(pref_data.size() + 1), done(pref_data.size() + 1);
+    std::size_t count{};
+    std::for_each(table.begin(), table.end(), [&followers, &count] (const auto& v) {
+        // for some reason a prefix is out of range, a logic error or somebody corrupted the model
+        if (followers.size() <= v.first || (v.second.size() == 1 && followers.size() <= v.second.begin()->second.second))
+            throw std::invalid_argument("invalid prefix");
+        if (v.second.size() != 1)
+            return;
+        followers[v.second.begin()->second.second] = true;
+        ++count;
+    });
+    const auto heads(std::count_if(table.begin(), table.end(), [&followers] (const auto& v) {
+        return v.second.size() == 1 && !followers[v.first];
+    }));
+
+    run_data.clear();
+    // the words of the runs and the ends of the runs (cycles are rare)
+    run_data.reserve(count + heads);
+    // a run ends where the next prefix is already in another run, the generation continues with that run
+    const auto build = [this, &done] (decltype(table)::iterator iter) {
+        if (iter->second.size() != 1 || done[iter->first])
+            return;
+        for (; iter != table.end() && iter->second.size() == 1 && !done[iter->first];
+            iter = table.find(run_data.back().second))
+        {
+            done[iter->first] = true;
+            auto& v(iter->second.begin()->second);
+            run_data.push_back(v);
+            v.first = run_data.size() - 1;
+        }
+        run_data.emplace_back(~std::size_t(), ~std::size_t());
+    };
+    for (auto iter = table.begin(); iter != table.end(); ++iter)
+        if (!followers[iter->first])
+            build(iter);
+    for (auto iter = table.begin(); iter != table.end(); ++iter)
+        build(iter);
+}
+
+void generating::handle::load(std::istream& is)
+{
+    // the model is loaded in place because its indexes refer to its own buffers
+    const auto m(std::make_shared<model>(0));
+    m->load(is);
+    std::atomic_store(&current, std::shared_ptr<const model>(m));
+}
+
+void generating::handle::freeze(training::model& m)
+{
+    const auto g(std::make_shared<model>(0));
+    g->freeze(m);
+    std::atomic_store(&current, std::shared_ptr<const model>(g));
+}
+
+generating::handle::~handle()
+{
+    if (loader.joinable())
+        loader.join();
+}
+
+void generating::handle::reload(const std::string& name)
+{
+    if (loader.joinable())
+        loader.join();
+    error = nullptr;
+    loader = std::thread([this, name] () {
+        try
+        {
+            std::ifstream is(name, std::ios_base::binary);
+            if (!is.is_open())
+                throw std::runtime_error("cannot open model file " + name);
+            load(is);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+    });
+}
+
+void generating::handle::wait()
+{
+    if (loader.joinable())
+        loader.join();
+    if (const auto e = error)
+    {
+        error = nullptr;
+        std::rethrow_exception(e);
+    }
+}
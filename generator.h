@@ -1,14 +1,19 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <cstring>
+#include <exception>
 #include <istream>
 #include <iterator>
 #include <list>
 #include <map>
+#include <memory>
 #include <random>
 #include <set>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -71,6 +76,11 @@ namespace text
                 { return compare(std::begin(l), std::end(l), std::begin(*data) + r, std::begin(*data) + r + size); }
             };
 
+        protected:
+            // takes the buffers and the table of another model, the indexes are rebuilt
+            // because they refer to the buffers of their own model
+            void assign(model& m);
+
         protected:
             // buffer with '\0' separated unique words
             std::vector<char> word_data;
@@ -86,12 +96,34 @@ namespace text
             std::set<std::size_t, lgcmp> pref_index;
             // mapping between a prefix (position in pref_data) and its suffixes
             // training: suffixes is mapping between a word (position in word_data) and its frequency and the prefix ending with the word
-            // generating: suffixes is mapping between an upper bound of a word frequency range and the word and the prefix ending with the word
+            // generating: suffixes is mapping between an upper bound of a word frequency range and the word id and the prefix ending with the word,
+            // a prefix with the only suffix stores a position in run_data instead of the word id (see generating::model::compress)
             std::unordered_map<std::size_t, std::map<std::size_t, std::pair<std::size_t, std::size_t>>> table;
         };
 
         namespace training
         {
+            // n-gram counts of a chunk of a text, chunks are counted without a model (so concurrently)
+            // and then merged into a model in the input order (see model::train)
+            // the words at the beginning of a chunk are not counted because their prefixes contain
+            // words of the previous chunk, they are trained when the chunk is merged
+            struct chunk
+            {
+                // unique words in the order of their first appearance
+                std::vector<std::string> words;
+                // the first pref_size words (ids in words), all words of a short chunk
+                std::vector<std::size_t> head;
+                // unique prefixes (pref_size word ids each) in the order of their first appearance
+                std::vector<std::size_t> prefs;
+                // prefixes (ids in prefs) in the order of their first appearance and their suffixes
+                // (mapping between a word id and its frequency and the prefix id ending with the word)
+                std::vector<std::pair<std::size_t, std::unordered_map<std::size_t, std::pair<std::size_t, std::size_t>>>> table;
+                // the prefix id at the end of the chunk (if the chunk is not short)
+                std::size_t last = ~std::size_t();
+            };
+
+            chunk count(const std::vector<std::string>& words, std::size_t pref_size);
+
             class model : public generator::model
             {
             public:
@@ -101,6 +133,13 @@ namespace text
                 // the state is a sequence of words (the prefix) and the prefix position
                 // so state.size() == prefix.size() + 1
                 void train(std::list<std::size_t>& state, const char* word);
+                // merges a chunk, the model is exactly the same as after training word by word
+                // (words, prefixes and suffixes are inserted in the same order)
+                void train(std::list<std::size_t>& state, const chunk& c);
+
+                // renumbers words by frequency and prefixes by the most probable chains
+                // the states of training sessions are invalidated
+                void reorder();
 
                 void save(std::ostream& os) const;
             };
@@ -120,7 +159,92 @@ namespace text
                 const char* generate(std::list<std::size_t>& state,
                     std::default_random_engine& urng) const;
 
+                // generates up to size words at once and appends them to words, less words are appended
+                // only if the session is finished, runs of prefixes with the only suffix are emitted as a whole
+                // (see compress), so such words do not need lookups and random numbers
+                void generate(std::list<std::size_t>& state, std::default_random_engine& urng,
+                    std::vector<const char*>& words, std::size_t size) const;
+                // the same, but word ids are appended instead of words, see word
+                void generate(std::list<std::size_t>& state, std::default_random_engine& urng,
+                    std::vector<std::size_t>& ids, std::size_t size) const;
+
+                // advances independent sessions by up to size words each and appends the words of the session i
+                // to words[i] as the version above does, so the result of every session is the same as the result
+                // of separate calls, but the sessions are processed in lockstep: the table entry of the next prefix
+                // of a session is found and prefetched after its word, so it is ready when the other sessions are done
+                // and the throughput of one thread is not bound by the memory latency of one session
+                void generate(std::vector<std::list<std::size_t>>& states, std::vector<std::default_random_engine>& urngs,
+                    std::vector<std::vector<const char*>>& words, std::size_t size) const;
+                // the same, but word ids are appended instead of words
+                void generate(std::vector<std::list<std::size_t>>& states, std::vector<std::default_random_engine>& urngs,
+                    std::vector<std::vector<std::size_t>>& ids, std::size_t size) const;
+
+                // word ids are numbers of words in word_data, so they are compact (0 <= id < word_count())
+                // and the most frequent words have the smallest ids if the model was sorted before save
+                std::size_t word_count() const { return word_positions.size(); }
+                const char* word(std::size_t id) const;
+                // the position of a word in word_data (the same as find returns), so a state can be made of word ids
+                std::size_t word_position(std::size_t id) const;
+
                 void load(std::istream& is);
+                // takes the training model data without serialization, so the training model is empty after that
+                // the result is the same as the result of save and load
+                void freeze(training::model& m);
+
+            private:
+                template<class F>
+                void generate(std::list<std::size_t>& state, std::default_random_engine& urng, std::size_t size, F f) const;
+                template<class F>
+                void generate(std::vector<std::list<std::size_t>>& states, std::vector<std::default_random_engine>& urngs,
+                    std::size_t size, F f) const;
+                std::size_t generate(const decltype(table)::mapped_type& second,
+                    std::list<std::size_t>& state, std::default_random_engine& urng) const;
+
+                // replaces word positions in the table with word ids, so ids are generated without lookups
+                void number();
+
+                // finds runs of prefixes with the only suffix (boilerplate, quotations and so on)
+                // and stores the words and the next prefixes of every run in run_data one after another,
+                // the word id of such a prefix in the table is replaced with its position in run_data
+                void compress();
+
+            private:
+                // word positions in word_data by word ids
+                std::vector<std::size_t> word_positions;
+                // the word and the next prefix of every prefix with the only suffix, grouped by runs,
+                // every run ends with ~std::size_t() (the generation continues from the last next prefix)
+                std::vector<std::pair<std::size_t, std::size_t>> run_data;
+            };
+
+            // the class allows to replace a model of a long-running process without stopping it
+            // a model is published as an immutable snapshot, sessions keep the snapshot they started with
+            // so words returned by old sessions remain valid while new sessions use the new model
+            // we use atomic shared_ptr functions here, so readers never wait for a reload
+            class handle
+            {
+            public:
+                handle() = default;
+                handle(const handle&) = delete;
+                handle& operator=(const handle&) = delete;
+                // waits for the running reload, its error is ignored
+                ~handle();
+
+                // returns nullptr until a model is loaded
+                std::shared_ptr<const model> get() const { return std::atomic_load(&current); }
+
+                void load(std::istream& is);
+                void freeze(training::model& m);
+                // starts loading the model file in a background thread owned by the handle and returns,
+                // the model is published when it is ready, the thread of the previous reload is joined first
+                // (so the call waits only if the previous reload is still running)
+                void reload(const std::string& name);
+                // waits for the last reload and rethrows its error
+                void wait();
+
+            private:
+                std::shared_ptr<const model> current;
+                std::thread loader;
+                std::exception_ptr error;
             };
         }
 
@@ -147,21 +271,181 @@ namespace text
             return result;
         }
 
+        // the same, but the prefix is a sequence of word ids (see generating::model::word)
+        template<class I>
+        inline decltype(auto) state(const generating::model& m, const std::vector<I>& ids)
+        {
+            std::list<std::size_t> result;
+            std::transform(ids.begin(), ids.end(), std::back_inserter(result),
+                [&m] (auto id) { return m.word_position(id); });
+            result.push_back(m.find(result));
+            return result;
+        }
+
+        // sessions start from the first prefix if the prefix is empty
+        template<class P>
+        inline decltype(auto) start_state(const generating::model& m, const P& pref_list)
+        {
+            return pref_list.empty() ? state(m, first_prefix(m.pref_size())) : state(m, pref_list);
+        }
+
         inline decltype(auto) train(training::model& m)
         {
-            return [&m, state = state(m, first_prefix(m.pref_size()))] (const char* word) mutable
+            return [&m, state = state(m, first_prefix(m.pref_size()))] (const auto& word) mutable
             {
                 m.train(state, word);
             };
         }
 
+        // words are generated in batches, so runs are emitted as a whole
+        // end is returned when the session is finished, the prefix is a sequence of words or word ids
+        template<class T, class P>
+        inline decltype(auto) batch_generate(const generating::model& m, const P& pref_list, T end)
+        {
+            return [&m, state = start_state(m, pref_list),
+                urng = std::default_random_engine(), words = std::vector<T>(), first = std::size_t(), end] () mutable
+            {
+                if (first == words.size())
+                {
+                    words.clear();
+                    first = 0;
+                    m.generate(state, urng, words, 256);
+                }
+                return first == words.size() ? end : words[first++];
+            };
+        }
+
         inline decltype(auto) generate(const generating::model& m, const std::vector<std::string>& pref_list)
         {
-            return [&m, state = state(m, pref_list.empty() ? first_prefix(m.pref_size()) : pref_list),
-                urng = std::default_random_engine()] () mutable
+            return batch_generate<const char*>(m, pref_list, nullptr);
+        }
+
+        // the overloads for prefixes of word ids are templates, so {} is still an empty prefix of words
+        template<class I>
+        inline decltype(auto) generate(const generating::model& m, const std::vector<I>& ids)
+        {
+            return batch_generate<const char*>(m, ids, nullptr);
+        }
+
+        inline decltype(auto) generate_ids(const generating::model& m, const std::vector<std::string>& pref_list)
+        {
+            return batch_generate<std::size_t>(m, pref_list, ~std::size_t());
+        }
+
+        template<class I>
+        inline decltype(auto) generate_ids(const generating::model& m, const std::vector<I>& ids)
+        {
+            return batch_generate<std::size_t>(m, ids, ~std::size_t());
+        }
+
+        // the sessions are started from the same prefix, the session i uses the seed default_seed + first + i
+        // so the first session generates the same text as generate above (when first == 0)
+        // and texts can be generated in several rounds
+        // every call returns the next up to size words of every session, less words are returned
+        // only if the session is finished (so all sessions which are not finished return size words)
+        template<class T, class P>
+        inline decltype(auto) lockstep_generate(const generating::model& m, const P& pref_list,
+            std::size_t count, std::size_t first)
+        {
+            std::vector<std::default_random_engine> urngs;
+            for (std::size_t i = 0; i < count; ++i)
+                urngs.emplace_back(std::default_random_engine::default_seed + first + i);
+            return [&m, states = std::vector<std::list<std::size_t>>(count, start_state(m, pref_list)),
+                urngs = std::move(urngs), words = std::vector<std::vector<T>>(count)] (std::size_t size) mutable
+                -> const std::vector<std::vector<T>>&
+            {
+                std::for_each(words.begin(), words.end(), [] (auto& v) { v.clear(); });
+                m.generate(states, urngs, words, size);
+                return words;
+            };
+        }
+
+        inline decltype(auto) generate(const generating::model& m, const std::vector<std::string>& pref_list,
+            std::size_t count, std::size_t first = 0)
+        {
+            return lockstep_generate<const char*>(m, pref_list, count, first);
+        }
+
+        template<class I>
+        inline decltype(auto) generate(const generating::model& m, const std::vector<I>& ids,
+            std::size_t count, std::size_t first = 0)
+        {
+            return lockstep_generate<const char*>(m, ids, count, first);
+        }
+
+        inline decltype(auto) generate_ids(const generating::model& m, const std::vector<std::string>& pref_list,
+            std::size_t count, std::size_t first = 0)
+        {
+            return lockstep_generate<std::size_t>(m, pref_list, count, first);
+        }
+
+        template<class I>
+        inline decltype(auto) generate_ids(const generating::model& m, const std::vector<I>& ids,
+            std::size_t count, std::size_t first = 0)
+        {
+            return lockstep_generate<std::size_t>(m, ids, count, first);
+        }
+
+        // the session owns the model snapshot, so it is not affected by handle reloads
+        template<class F>
+        inline decltype(auto) snapshot_generate(std::shared_ptr<const generating::model> m, F f)
+        {
+            // a handle has no model until it is loaded
+            if (!m)
+                throw std::invalid_argument("no model");
+            // lockstep sessions take the number of words and return a reference to their words, so decltype(auto)
+            return [m, g = f(*m)] (auto... args) mutable -> decltype(auto)
             {
-                return m.generate(state, urng);
+                return g(args...);
             };
         }
+
+        inline decltype(auto) generate(std::shared_ptr<const generating::model> m, const std::vector<std::string>& pref_list)
+        {
+            return snapshot_generate(m, [&pref_list] (const auto& m) { return generate(m, pref_list); });
+        }
+
+        template<class I>
+        inline decltype(auto) generate(std::shared_ptr<const generating::model> m, const std::vector<I>& ids)
+        {
+            return snapshot_generate(m, [&ids] (const auto& m) { return generate(m, ids); });
+        }
+
+        inline decltype(auto) generate_ids(std::shared_ptr<const generating::model> m, const std::vector<std::string>& pref_list)
+        {
+            return snapshot_generate(m, [&pref_list] (const auto& m) { return generate_ids(m, pref_list); });
+        }
+
+        template<class I>
+        inline decltype(auto) generate_ids(std::shared_ptr<const generating::model> m, const std::vector<I>& ids)
+        {
+            return snapshot_generate(m, [&ids] (const auto& m) { return generate_ids(m, ids); });
+        }
+
+        inline decltype(auto) generate(std::shared_ptr<const generating::model> m, const std::vector<std::string>& pref_list,
+            std::size_t count, std::size_t first = 0)
+        {
+            return snapshot_generate(m, [&pref_list, count, first] (const auto& m) { return generate(m, pref_list, count, first); });
+        }
+
+        template<class I>
+        inline decltype(auto) generate(std::shared_ptr<const generating::model> m, const std::vector<I>& ids,
+            std::size_t count, std::size_t first = 0)
+        {
+            return snapshot_generate(m, [&ids, count, first] (const auto& m) { return generate(m, ids, count, first); });
+        }
+
+        inline decltype(auto) generate_ids(std::shared_ptr<const generating::model> m, const std::vector<std::string>& pref_list,
+            std::size_t count, std::size_t first = 0)
+        {
+            return snapshot_generate(m, [&pref_list, count, first] (const auto& m) { return generate_ids(m, pref_list, count, first); });
+        }
+
+        template<class I>
+        inline decltype(auto) generate_ids(std::shared_ptr<const generating::model> m, const std::vector<I>& ids,
+            std::size_t count, std::size_t first = 0)
+        {
+            return snapshot_generate(m, [&ids, count, first] (const auto& m) { return generate_ids(m, ids, count, first); });
+        }
     }
 }
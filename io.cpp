@@ -1,6 +1,25 @@
 #include "io.h"
+#include <algorithm>
+#include <array>
 #include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <initializer_list>
+#include <ios>
+#include <locale>
+#include <mutex>
 #include <system_error>
+#include <thread>
+#include <vector>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #ifdef __GNUC__
 #include <ext/stdio_filebuf.h>
@@ -24,14 +43,273 @@ namespace
     {
         return std::system_error(errno, std::generic_category(), context);
     }
+
+    // the buffer reads a file in a separate thread, so reading and decompression overlap
+    // with the consumer, the thread is started by the first read and it is ahead
+    // of the consumer by a few chunks at most
+    class pipebuf : public std::streambuf
+    {
+    public:
+        explicit pipebuf(std::FILE* f) : file(f) {}
+
+        ~pipebuf()
+        {
+            join();
+        }
+
+        // stops the thread and rethrows its error
+        void close()
+        {
+            join();
+            if (error)
+                std::rethrow_exception(error);
+        }
+
+    protected:
+        int_type underflow() override
+        {
+            if (!thread.joinable())
+                thread = std::thread(&pipebuf::run, this);
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return !chunks.empty() || done; });
+            if (chunks.empty())
+                return traits_type::eof();
+            current = std::move(chunks.front());
+            chunks.pop_front();
+            lock.unlock();
+            cv.notify_all();
+            setg(current.data(), current.data(), current.data() + current.size());
+            return traits_type::to_int_type(*gptr());
+        }
+
+    private:
+        static const std::size_t chunk_size = 1 << 16;
+        static const std::size_t queue_size = 4;
+
+        void join()
+        {
+            {
+                const std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            cv.notify_all();
+            if (thread.joinable())
+                thread.join();
+        }
+
+        std::vector<char> read()
+        {
+            std::vector<char> result(chunk_size);
+            result.resize(std::fread(result.data(), 1, result.size(), file));
+            if (std::ferror(file))
+                throw last_error(__func__);
+            return result;
+        }
+
+        // returns false if the consumer does not need data anymore
+        bool write(std::vector<char>&& chunk)
+        {
+            if (chunk.empty())
+                return true;
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return chunks.size() < queue_size || stop; });
+            if (stop)
+                return false;
+            chunks.push_back(std::move(chunk));
+            lock.unlock();
+            cv.notify_all();
+            return true;
+        }
+
+        void run()
+        {
+            try
+            {
+                auto chunk(read());
+                const auto magic = [&chunk] (std::initializer_list<unsigned char> m) {
+                    return m.size() <= chunk.size() && std::equal(m.begin(), m.end(), chunk.begin(),
+                        [] (auto l, auto r) { return l == static_cast<unsigned char>(r); });
+                };
+                if (magic({ 0x1f, 0x8b }))
+                    gunzip(std::move(chunk));
+                else if (magic({ 0x28, 0xb5, 0x2f, 0xfd }))
+                    unzstd(std::move(chunk));
+                else
+                    while (write(std::move(chunk)) && !(chunk = read()).empty());
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+            {
+                const std::lock_guard<std::mutex> lock(mutex);
+                done = true;
+            }
+            cv.notify_all();
+        }
+
+        void gunzip(std::vector<char>&& chunk)
+        {
+#ifdef HAVE_ZLIB
+            z_stream z = {};
+            z.next_in = reinterpret_cast<Bytef*>(chunk.data());
+            z.avail_in = static_cast<uInt>(chunk.size());
+            // 32 enables gzip header detection
+            if (inflateInit2(&z, MAX_WBITS + 32) != Z_OK)
+                throw std::runtime_error("gzip init error");
+            const std::unique_ptr<z_stream, int (*)(z_stream*)> guard(&z, &inflateEnd);
+            // a gzip file can contain several members one after another
+            // if the output is full, the decoder can have more data of a member even without more input
+            bool end = false, full = false;
+            for (;;)
+            {
+                if (z.avail_in == 0 && (end || !full))
+                {
+                    if ((chunk = read()).empty())
+                        break;
+                    z.next_in = reinterpret_cast<Bytef*>(chunk.data());
+                    z.avail_in = static_cast<uInt>(chunk.size());
+                }
+                if (end)
+                {
+                    inflateReset(&z);
+                    end = false;
+                }
+                std::vector<char> out(chunk_size);
+                z.next_out = reinterpret_cast<Bytef*>(out.data());
+                z.avail_out = static_cast<uInt>(out.size());
+                const int r(inflate(&z, Z_NO_FLUSH));
+                if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR)
+                    throw std::runtime_error("gzip error " + std::to_string(r));
+                end = r == Z_STREAM_END;
+                full = z.avail_out == 0;
+                out.resize(out.size() - z.avail_out);
+                if (!write(std::move(out)))
+                    return;
+            }
+            if (!end)
+                throw std::runtime_error("gzip unexpected end");
+#else
+            (void)chunk;
+            throw std::runtime_error("gzip is not supported");
+#endif
+        }
+
+        void unzstd(std::vector<char>&& chunk)
+        {
+#ifdef HAVE_ZSTD
+            const std::unique_ptr<ZSTD_DStream, std::size_t (*)(ZSTD_DStream*)> z(ZSTD_createDStream(), &ZSTD_freeDStream);
+            if (!z || ZSTD_isError(ZSTD_initDStream(z.get())))
+                throw std::runtime_error("zstd init error");
+            ZSTD_inBuffer in = { chunk.data(), chunk.size(), 0 };
+            // the stream can contain several frames one after another, 0 means the end of a frame
+            // if the output is full, the decoder can have more data of a frame even without more input
+            bool full = false;
+            for (std::size_t r = 0; ; )
+            {
+                if (in.pos == in.size && (r == 0 || !full))
+                {
+                    if ((chunk = read()).empty())
+                    {
+                        if (r != 0)
+                            throw std::runtime_error("zstd unexpected end");
+                        break;
+                    }
+                    in = { chunk.data(), chunk.size(), 0 };
+                }
+                std::vector<char> out(chunk_size);
+                ZSTD_outBuffer o = { out.data(), out.size(), 0 };
+                r = ZSTD_decompressStream(z.get(), &o, &in);
+                if (ZSTD_isError(r))
+                    throw std::runtime_error(std::string("zstd error ") + ZSTD_getErrorName(r));
+                full = o.pos == o.size;
+                out.resize(o.pos);
+                if (!write(std::move(out)))
+                    return;
+            }
+#else
+            (void)chunk;
+            throw std::runtime_error("zstd is not supported");
+#endif
+        }
+
+        std::FILE* const file;
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<std::vector<char>> chunks;
+        std::vector<char> current;
+        bool done = false;
+        bool stop = false;
+        std::exception_ptr error;
+        std::thread thread;
+    };
+
+    // the buffer converts bytes of another buffer to wide characters using the global locale
+    // (the same as filebuf does), we do not use wbuffer_convert because its libstdc++ implementation
+    // returns garbage if a multibyte character is split between two reads of the byte buffer
+    class convbuf : public std::wstreambuf
+    {
+    public:
+        explicit convbuf(std::streambuf* sb) : sb(sb), cvt(std::use_facet<codecvt_type>(loc)) {}
+
+    protected:
+        int_type underflow() override
+        {
+            for (;;)
+            {
+                // the characters before an invalid byte sequence are returned, then the next call throws,
+                // so a stream sets badbit and an invalid input is not mistaken for the end of the data
+                if (invalid)
+                    throw std::ios_base::failure("invalid byte sequence");
+                const auto n(sb->sgetn(bytes.data() + unconverted, bytes.size() - unconverted));
+                const char* const last(bytes.data() + unconverted + n);
+                if (last == bytes.data())
+                    return traits_type::eof();
+                const char* next;
+                wchar_t* wnext;
+                const auto r(cvt.in(state, bytes.data(), last, next, chars.data(), chars.data() + chars.size(), wnext));
+                invalid = r == std::codecvt_base::error;
+                unconverted = last - next;
+                std::copy(next, last, bytes.begin());
+                if (wnext != chars.data())
+                {
+                    setg(chars.data(), chars.data(), wnext);
+                    return traits_type::to_int_type(*gptr());
+                }
+                // an incomplete character at the end of the data
+                if (n == 0)
+                    return traits_type::eof();
+            }
+        }
+
+    private:
+        using codecvt_type = std::codecvt<wchar_t, char, std::mbstate_t>;
+
+        std::streambuf* const sb;
+        const std::locale loc;
+        const codecvt_type& cvt;
+        std::mbstate_t state{};
+        std::array<char, 1 << 12> bytes;
+        std::size_t unconverted{};
+        std::array<wchar_t, 1 << 12> chars;
+        bool invalid = false;
+    };
 }
 
-io::filebuf_ptr::filebuf_ptr(std::FILE* f, close_type* c)
+io::filebuf_ptr::filebuf_ptr(std::FILE* f, close_type* c, bool decompress)
     : close_result(std::make_unique<int>(0))
     , file(f, [&r = *close_result, c] (auto f) { return r = c(f); })
-    , buffer(std::make_unique<filebuf>(f))
 {
-    buffer->pubimbue(std::locale());
+    if (decompress)
+    {
+        source = std::make_unique<pipebuf>(f);
+        buffer = std::make_unique<convbuf>(source.get());
+    }
+    else
+    {
+        buffer = std::make_unique<filebuf>(f);
+        buffer->pubimbue(std::locale());
+    }
 }
 
 std::wstreambuf* io::filebuf_ptr::get() const noexcept
@@ -42,17 +320,23 @@ std::wstreambuf* io::filebuf_ptr::get() const noexcept
 void io::filebuf_ptr::reset()
 {
     buffer.reset();
+    // the thread is stopped before the file is closed
+    if (const std::unique_ptr<std::streambuf> s = std::move(source))
+        static_cast<pipebuf&>(*s).close();
     file.reset();
     if (const int r = *close_result)
         throw std::runtime_error("file close error " + std::to_string(r));
 }
 
-io::filebuf_ptr io::popen(const std::string& c, const std::string& m)
+io::filebuf_ptr io::popen(const std::string& c, const std::string& m, bool decompress)
 {
     const auto file(::popen(c.c_str(), m.c_str()));
     if (file == nullptr)
         throw last_error(__func__);
-    return filebuf_ptr(file, &::pclose);
+    // compressed data is binary
+    if (decompress)
+        setmode(file, true);
+    return filebuf_ptr(file, &::pclose, decompress);
 }
 
 bool io::setmode(std::FILE* f, bool binary)
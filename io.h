@@ -12,17 +12,20 @@ namespace io
     {
         using close_type = int (std::FILE*);
     public:
-        filebuf_ptr(std::FILE* f, close_type* c);
+        // if decompress is true, the file is read in a separate thread and gzip/zstd data
+        // is detected by its magic number and decompressed on the fly
+        filebuf_ptr(std::FILE* f, close_type* c, bool decompress = false);
         std::wstreambuf* get() const noexcept;
         void reset();
 
     private:
         std::unique_ptr<int> close_result;
         std::unique_ptr<std::FILE, std::function<close_type>> file;
+        std::unique_ptr<std::streambuf> source;
         std::unique_ptr<std::wstreambuf> buffer;
     };
 
-    filebuf_ptr popen(const std::string& c, const std::string& m);
+    filebuf_ptr popen(const std::string& c, const std::string& m, bool decompress = false);
 
     bool setmode(std::FILE* f, bool binary);
 }
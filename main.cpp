@@ -3,10 +3,12 @@
 #include "iterator.h"
 #include "program.h"
 #include "string.h"
+#include <cstdint>
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <thread>
 
 using namespace iterator;
 using namespace program;
@@ -31,11 +33,18 @@ namespace
 
     inline decltype(auto) download(const std::string& url)
     {
-        return io::popen("curl -s " + url, "r");
+        return io::popen("curl -s " + url, "r", true);
+    }
+
+    template<class S>
+    void train(training::model& model, S s)
+    {
+        std::for_each(ifunction_begin(s), ifunction_end(s),
+            [t = train(model)] (const auto& s) mutable { t(s.c_str()); });
     }
 
     void train(training::model& model, const std::vector<std::string>& urls,
-        const std::wregex& re, std::size_t concurrency)
+        const std::wregex& re, std::size_t concurrency, std::size_t threads)
     {
         std::list<io::filebuf_ptr> files;
         for (auto iter = urls.begin(); iter != urls.end() || files.begin() != files.end();
@@ -43,21 +52,118 @@ namespace
         {
             while (iter != urls.end() && files.size() < concurrency)
                 files.push_back(download(*iter++));
-            auto s(string::search(files.front().get(), re));
-            std::for_each(ifunction_begin(s), ifunction_end(s),
-                [t = train(model)] (const auto& s) mutable { t(s.c_str()); });
+            // n-grams of chunks are counted concurrently and merged in the input order
+            if (threads > 1)
+                string::search(files.front().get(), re, threads,
+                    [pref_size = model.pref_size()] (const auto& words) { return training::count(words, pref_size); },
+                    train(model));
+            else
+                train(model, string::search(files.front().get(), re));
         }
     }
 
-    void generate(const generating::model& model, const std::wstring& prefix,
-        const std::wregex& re, std::size_t text_size)
+    std::vector<std::size_t> id_list(const std::string& id_prefix)
     {
+        std::istringstream is(id_prefix);
+        std::vector<std::size_t> result((std::istream_iterator<std::size_t>(is)), std::istream_iterator<std::size_t>());
+        if (!is.eof())
+            throw std::invalid_argument("invalid word id prefix");
+        return result;
+    }
+
+    std::vector<std::string> prefix_list(const std::wstring& prefix, const std::wregex& re)
+    {
+        std::vector<std::string> result;
         std::wstringbuf psb(prefix);
         auto s(string::search(&psb, re));
-        const std::vector<std::string> pref_list(ifunction_begin(s), ifunction_end(s));
-        auto g(generate(model, pref_list));
-        std::copy(ifunction_begin(g, std::size_t()), ifunction_end(g, text_size),
-            std::ostream_iterator<const char*>(std::cout, " "));
+        std::copy(ifunction_begin(s), ifunction_end(s), std::back_inserter(result));
+        return result;
+    }
+
+    // the texts are generated in lockstep in rounds, so the memory is bounded by lockstep_words words:
+    // the first text of a round is written while it is generated, the others are kept until the round is finished
+    const std::size_t lockstep_words = 1 << 24;
+    // the words of every text are generated in batches, so runs are emitted as a whole
+    const std::size_t lockstep_batch = 256;
+
+    template<class T, class F, class W, class E>
+    void lockstep(F f, std::size_t text_size, std::size_t text_count, W write, E finish)
+    {
+        const auto round(std::max<std::size_t>(lockstep_words / std::max<std::size_t>(text_size, 1), 1));
+        for (std::size_t first = 0; first < text_count; first += round)
+        {
+            const auto count(std::min(round, text_count - first));
+            auto g(f(count, first));
+            std::vector<std::vector<T>> texts(count - 1);
+            for (std::size_t size = 0; size < text_size; )
+            {
+                const auto batch(std::min(lockstep_batch, text_size - size));
+                const auto& words(g(batch));
+                if (std::all_of(words.begin(), words.end(), [] (const auto& v) { return v.empty(); }))
+                    break;
+                std::for_each(words.front().begin(), words.front().end(), write);
+                for (std::size_t j = 1; j < count; ++j)
+                    texts[j - 1].insert(texts[j - 1].end(), words[j].begin(), words[j].end());
+                size += batch;
+            }
+            finish(first);
+            for (std::size_t j = 1; j < count; ++j)
+            {
+                std::for_each(texts[j - 1].begin(), texts[j - 1].end(), write);
+                std::vector<T>().swap(texts[j - 1]);
+                finish(first + j);
+            }
+        }
+    }
+
+    // the prefix is a sequence of words or word ids
+    template<class P>
+    void write_text(std::shared_ptr<const generating::model> model, const P& pref_list,
+        std::size_t text_size, std::size_t text_count)
+    {
+        if (text_count == 1)
+        {
+            auto g(generate(model, pref_list));
+            std::copy(ifunction_begin(g, std::size_t()), ifunction_end(g, text_size),
+                std::ostream_iterator<const char*>(std::cout, " "));
+            return;
+        }
+        lockstep<const char*>([&model, &pref_list] (auto count, auto first) { return generate(model, pref_list, count, first); },
+            text_size, text_count, [] (auto word) { std::cout << word << ' '; },
+            [text_count] (auto i) { if (i + 1 < text_count) std::cout << '\n'; });
+    }
+
+    // word ids are written as 32-bit unsigned integers in the native byte order,
+    // every text ends with 0xffffffff
+    template<class P>
+    void write_ids(std::shared_ptr<const generating::model> model, const P& pref_list,
+        std::size_t text_size, std::size_t text_count)
+    {
+        const std::uint32_t end(~std::uint32_t());
+        if (end <= model->word_count())
+            throw std::length_error("too many words for 32-bit ids");
+        const auto write = [end] (auto id) {
+            const std::uint32_t v(id == ~std::size_t() ? end : static_cast<std::uint32_t>(id));
+            std::cout.write(reinterpret_cast<const char*>(&v), sizeof(v));
+        };
+        if (text_count == 1)
+        {
+            auto g(generate_ids(model, pref_list));
+            std::for_each(ifunction_begin(g, std::size_t()), ifunction_end(g, text_size, ~std::size_t()), write);
+            write(~std::size_t());
+            return;
+        }
+        lockstep<std::size_t>([&model, &pref_list] (auto count, auto first) { return generate_ids(model, pref_list, count, first); },
+            text_size, text_count, write, [&write] (auto) { write(~std::size_t()); });
+    }
+
+    // the vocabulary is written as words separated by new lines in the order of word ids
+    void write_vocabulary(const generating::model& model, const std::string& name)
+    {
+        std::ofstream os(name, std::ios_base::binary);
+        os.exceptions(std::ios_base::failbit | std::ios_base::badbit);
+        for (std::size_t id = 0; id < model.word_count(); ++id)
+            os << model.word(id) << '\n';
     }
 }
 
@@ -79,8 +185,14 @@ int main(int argc, char* argv[])
         args.add("-r", "word regex", "\\w+");
         args.add("-n", "text prefix length", std::size_t(1));
         args.add("-c", "download concurrency", std::size_t(1000));
+        args.add("-j", "training threads per download (hardware concurrency by default)");
         args.add("-w", "generated text size", std::size_t(1000000));
+        args.add("-k", "number of generated texts", std::size_t(1));
         args.add("-p", "generated text prefix");
+        args.add("-q", "generated text prefix of word ids");
+        args.add("-b", "write word ids instead of text", false, true);
+        args.add("-v", "vocabulary output file");
+        args.add("-s", "sort model by word and chain frequency", false, true);
         args.parse(argc, argv);
 
         std::locale::global(std::locale(args.get("-l")));
@@ -88,21 +200,28 @@ int main(int argc, char* argv[])
         const auto help_flag(std::stoi(args.get("-h")) != 0);
         const auto train_flag(std::stoi(args.get("-t")) != 0);
         const auto generate_flag(std::stoi(args.get("-g")) != 0);
+        const auto sort_flag(std::stoi(args.get("-s")) != 0);
+        const auto binary_flag(std::stoi(args.get("-b")) != 0);
         const auto urls(args.get());
         const auto iname(args.get("-i"));
         const auto oname(args.get("-o"));
+        const auto vname(args.get("-v"));
         const std::wregex re(converter->from_bytes(args.get("-r")));
         const auto prefix(converter->from_bytes(args.get("-p")));
+        const auto id_prefix(args.get("-q"));
         const auto prefix_size(std::stoull(args.get("-n")));
         const auto concurrency(std::max(std::stoull(args.get("-c")), 1ull));
         const auto text_size(std::stoull(args.get("-w")));
+        const auto text_count(std::max(std::stoull(args.get("-k")), 1ull));
+        const auto threads(args.get("-j").empty() ?
+            std::max<std::size_t>(std::thread::hardware_concurrency(), 1) : std::stoull(args.get("-j")));
 
         // replace std::cin/std::cout rdbufs if input/output files are provided        
         const auto ifile(iname.empty() ? std::shared_ptr<std::ios>() :
             set_rdbuf(std::make_shared<std::ifstream>(iname, std::ios_base::binary), std::cin));
         const auto ofile(oname.empty() ? std::shared_ptr<std::ios>() :
             set_rdbuf(std::make_shared<std::ofstream>(oname, std::ios_base::binary), std::cout));
-        std::stringstream memfile;
+        generating::handle handle;
 
         if (help_flag || !(train_flag || generate_flag))
             std::cerr << args.help() << std::endl;
@@ -110,15 +229,32 @@ int main(int argc, char* argv[])
         if (train_flag)
         {
             training::model model(prefix_size);
-            train(model, urls, re, concurrency);
-            model.save(generate_flag ? memfile : std::cout);
+            train(model, urls, re, concurrency, threads);
+            if (sort_flag)
+                model.reorder();
+            if (generate_flag)
+                handle.freeze(model);
+            else
+                model.save(std::cout);
         }
 
         if (generate_flag)
         {
-            generating::model model(prefix_size);
-            model.load(train_flag ? memfile : std::cin);
-            generate(model, prefix, re, text_size);
+            if (!train_flag)
+                handle.load(std::cin);
+            const auto model(handle.get());
+            if (!vname.empty())
+                write_vocabulary(*model, vname);
+            const auto write = [&model, binary_flag, text_size, text_count] (const auto& pref_list) {
+                if (binary_flag)
+                    write_ids(model, pref_list, text_size, text_count);
+                else
+                    write_text(model, pref_list, text_size, text_count);
+            };
+            if (id_prefix.empty())
+                write(prefix_list(prefix, re));
+            else
+                write(id_list(id_prefix));
         }
     }
     catch (const std::exception& e)
@@ -1,9 +1,14 @@
 #pragma once
 
+#include <algorithm>
+#include <deque>
+#include <future>
+#include <istream>
 #include <locale>
 #include <memory>
 #include <regex>
 #include <string>
+#include <vector>
 
 namespace string
 {
@@ -17,6 +22,16 @@ namespace string
         return std::make_shared<std::wstring_convert<codecvt>>();
     }
 
+    // the same as std::getline, but a line read before a stream error is returned too
+    // (a stream sets badbit if its buffer throws, on an invalid byte sequence for example)
+    inline bool read_line(std::wistream& wis, std::wstring& line)
+    {
+        if (!wis)
+            return false;
+        line.clear();
+        return std::getline(wis, line) || !line.empty();
+    }
+
     // the function works with a character stream and do not require random access
     // so it can work with any character device (tapes for example)
     // we need wchar_t to work with encodings which require more than 1 byte per character
@@ -39,10 +54,16 @@ namespace string
         {
             // we have to read a line because regex_iterator does not work
             // with input_iterator (istreambuf_iterator)
-            while (first == last && std::getline(*wis, *line))
-                first = std::wsregex_iterator(line->begin(), line->end(), *wre);
-            if (first == last)
-                return std::string();
+            // empty matches (of \w* for example) are skipped, because an empty word is the end of input
+            for (;; ++first)
+            {
+                while (first == last && read_line(*wis, *line))
+                    first = std::wsregex_iterator(line->begin(), line->end(), *wre);
+                if (first == last)
+                    return std::string();
+                if (first->length())
+                    break;
+            }
             // we implicitly use std::ctype for character classification here
             std::wstring result((first++)->str());
             // we explicitly use std::ctype for tolower here
@@ -50,4 +71,53 @@ namespace string
             return wsc->to_bytes(result);
         };
     }
+
+    // the parallel version of search for large inputs
+    // lines are read in chunks (at least chunk_size characters), up to threads chunks are tokenized
+    // concurrently and f is applied to the words of every chunk in the same thread (so f must be thread safe),
+    // then g is applied to the results in the input order (regex matches never cross line boundaries)
+    // empty matches are skipped as in the sequential version
+    template<class F, class G>
+    inline void search(std::wstreambuf* sb, const std::wregex& re, std::size_t threads, F f, G g,
+        std::size_t chunk_size = 1 << 20)
+    {
+        using result_type = decltype(f(std::declval<const std::vector<std::string>&>()));
+        const std::locale loc;
+        std::wistream wis(sb);
+        // pending chunks are waited for on an exception, so the deque is destroyed first
+        std::deque<std::future<result_type>> chunks;
+        for (;;)
+        {
+            while (chunks.size() < threads && wis)
+            {
+                std::vector<std::wstring> lines;
+                std::size_t size{};
+                for (std::wstring line; size < chunk_size && read_line(wis, line); size += line.size() + 1)
+                    lines.push_back(std::move(line));
+                if (lines.empty())
+                    break;
+                chunks.push_back(std::async(std::launch::async, [&loc, &re, &f, lines = std::move(lines)] () {
+                    // wstring_convert is not thread safe, so every chunk has its own converter
+                    const auto& wct(std::use_facet<std::ctype<wchar_t>>(loc));
+                    const auto wsc(converter());
+                    std::vector<std::string> words;
+                    std::for_each(lines.begin(), lines.end(), [&wct, &wsc, &re, &words] (const auto& line) {
+                        std::for_each(std::wsregex_iterator(line.begin(), line.end(), re), std::wsregex_iterator(),
+                            [&wct, &wsc, &words] (const auto& m) {
+                                if (!m.length())
+                                    return;
+                                std::wstring word(m.str());
+                                wct.tolower(&word[0], &word[word.size()]);
+                                words.push_back(wsc->to_bytes(word));
+                            });
+                    });
+                    return f(static_cast<const std::vector<std::string>&>(words));
+                }));
+            }
+            if (chunks.empty())
+                return;
+            g(chunks.front().get());
+            chunks.pop_front();
+        }
+    }
 }
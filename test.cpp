@@ -0,0 +1,231 @@
+#include "generator.h"
+#include "iterator.h"
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+using namespace iterator;
+using namespace text::generator;
+
+namespace
+{
+    void check(bool condition, const std::string& what)
+    {
+        if (!condition)
+            throw std::logic_error(what);
+    }
+
+    void train(training::model& m, const std::string& text)
+    {
+        std::istringstream is(text);
+        auto t(train(m));
+        std::for_each(std::istream_iterator<std::string>(is), std::istream_iterator<std::string>(),
+            [&t] (const auto& w) { t(w.c_str()); });
+    }
+
+    void save(const std::string& name, const std::string& text, std::size_t pref_size = 1)
+    {
+        training::model m(pref_size);
+        train(m, text);
+        std::ofstream os(name, std::ios_base::binary);
+        m.save(os);
+    }
+
+    template<class G>
+    std::string text(G g, std::size_t size = 1000)
+    {
+        std::ostringstream os;
+        std::copy(ifunction_begin(g, std::size_t()), ifunction_end(g, size),
+            std::ostream_iterator<const char*>(os, " "));
+        return os.str();
+    }
+
+    template<class G>
+    std::vector<std::size_t> words(G g, std::size_t size = 1000)
+    {
+        return std::vector<std::size_t>(ifunction_begin(g, std::size_t()), ifunction_end(g, size, ~std::size_t()));
+    }
+
+    void handle_without_model()
+    {
+        generating::handle h;
+        check(h.get() == nullptr, "empty handle");
+        try
+        {
+            generate(h.get(), {});
+        }
+        catch (const std::invalid_argument&)
+        {
+            return;
+        }
+        check(false, "no exception");
+    }
+
+    void handle_reload()
+    {
+        save("reload1.model", "one two three");
+        save("reload2.model", "four five six");
+        generating::handle h;
+        h.reload("reload1.model");
+        h.wait();
+        auto g1(generate(h.get(), {}));
+        check(std::string(g1()) == "one", "first model");
+        // the count is std::size_t, otherwise std::generate is found by ADL (shared_ptr is in std)
+        const std::size_t count = 2;
+        auto l1(generate(h.get(), {}, count));
+        h.reload("reload2.model");
+        h.wait();
+        // the old sessions keep their snapshot
+        check(text(g1) == "two three ", "old session");
+        const auto& words(l1(1));
+        check(std::string(words[0].at(0)) == "one" && std::string(words[1].at(0)) == "one", "old lockstep session");
+        check(text(generate(h.get(), {})) == "four five six ", "new session");
+        // a failed reload keeps the current model
+        h.reload("missing.model");
+        try
+        {
+            h.wait();
+            check(false, "no exception");
+        }
+        catch (const std::runtime_error& e)
+        {
+            check(std::string(e.what()) == "cannot open model file missing.model", "open error");
+        }
+        check(text(generate(h.get(), {})) == "four five six ", "model after failure");
+        // the destructor waits for the running reload
+        h.reload("reload1.model");
+    }
+
+    std::shared_ptr<const generating::model> frozen(const std::string& text, std::size_t pref_size = 1)
+    {
+        training::model t(pref_size);
+        train(t, text);
+        const auto m(std::make_shared<generating::model>(pref_size));
+        m->freeze(t);
+        return m;
+    }
+
+    std::size_t id(const generating::model& m, const std::string& word)
+    {
+        for (std::size_t i = 0; i < m.word_count(); ++i)
+            if (m.word(i) == word)
+                return i;
+        throw std::invalid_argument("invalid word");
+    }
+
+    void id_prefix()
+    {
+        const auto m(frozen("one two three four five", 2));
+        const std::vector<std::size_t> ids = { id(*m, "two"), id(*m, "three") };
+        check(text(generate(*m, ids)) == "four five ", "word session");
+        check(text(generate(m, ids)) == "four five ", "snapshot word session");
+        // 32-bit ids of the binary output
+        const std::vector<std::uint32_t> ids32(ids.begin(), ids.end());
+        check(text(generate(*m, ids32)) == "four five ", "32-bit ids");
+        const auto g(generate_ids(m, ids));
+        check(words(g) == std::vector<std::size_t>{ id(*m, "four"), id(*m, "five") }, "snapshot id session");
+        check(words(g) == words(generate_ids(*m, std::vector<std::string>{ "two", "three" })), "id session");
+        auto l(generate_ids(*m, ids, 2));
+        const auto first(l(256));
+        check(first.size() == 2 && first[0] == words(g) && first[1] == first[0], "lockstep id session");
+        try
+        {
+            generate_ids(m, std::vector<std::size_t>{ m->word_count(), 0 });
+            check(false, "no exception");
+        }
+        catch (const std::out_of_range&)
+        {
+        }
+        try
+        {
+            generate_ids(std::shared_ptr<const generating::model>(), ids);
+            check(false, "no exception");
+        }
+        catch (const std::invalid_argument&)
+        {
+        }
+    }
+
+    std::string model_data(const std::string& text)
+    {
+        training::model m(1);
+        train(m, text);
+        std::ostringstream os;
+        m.save(os);
+        return os.str();
+    }
+
+    std::string load_error(const std::string& data)
+    {
+        std::istringstream is(data);
+        try
+        {
+            const auto m(std::make_shared<generating::model>(1));
+            m->load(is);
+        }
+        catch (const std::runtime_error& e)
+        {
+            return e.what();
+        }
+        return std::string();
+    }
+
+    void model_truncated()
+    {
+        const auto data(model_data("one two three"));
+        check(load_error(data).empty(), "valid model");
+        check(load_error(data.substr(0, data.size() - 1)) == "truncated model", "truncated suffixes");
+        check(load_error(data.substr(0, 20)) == "truncated model", "truncated header");
+        check(load_error(std::string()) == "truncated model", "empty model");
+    }
+
+    void model_corrupted()
+    {
+        auto data(model_data("one two three"));
+        data[data.size() - 20] ^= 1;
+        check(load_error(data) == "corrupted model", "corrupted suffixes");
+        data = model_data("one two three");
+        data[20] ^= 1;
+        check(load_error(data) == "corrupted model", "corrupted header");
+    }
+
+    void model_old_format()
+    {
+        // the old format has no magic and version
+        const auto data(model_data("one two three"));
+        check(load_error(data.substr(16)) == "invalid model (not a model or a model of an old format)", "old model");
+        auto future(data);
+        future[8] = 2;
+        check(load_error(future) == "unsupported model format version 2", "new model");
+    }
+
+    const std::map<std::string, std::function<void()>> tests = {
+        { "handle_without_model", handle_without_model },
+        { "handle_reload", handle_reload },
+        { "model_truncated", model_truncated },
+        { "model_corrupted", model_corrupted },
+        { "model_old_format", model_old_format },
+        { "id_prefix", id_prefix },
+    };
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        if (argc != 2)
+            throw std::invalid_argument("usage: textgen_test <test>");
+        tests.at(argv[1])();
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}